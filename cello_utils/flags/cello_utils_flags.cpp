@@ -19,26 +19,74 @@
 
 #include <JuceHeader.h>
 
+#include <algorithm>
+#include <functional>
+
 #include "cello_utils_flags.h"
 
 namespace
 {
+const juce::Identifier allID { "all" };
 const juce::Identifier allowedID { "allowed" };
+const juce::Identifier anyID { "any" };
 const juce::Identifier conditionID { "condition" };
 const juce::Identifier disallowedID { "disallowed" };
 const juce::Identifier maxID { "max" };
 const juce::Identifier minID { "min" };
+const juce::Identifier notID { "not" };
 const juce::Identifier resultID { "result" };
 const juce::Identifier releasedID { "released" };
 const juce::Identifier typeID { "type" };
 const juce::Identifier valueID { "value" };
 } // namespace
 
+namespace cello::utils::detail
+{
+/**
+ * @brief Calls back whenever a tree or any of its descendants changes, so
+ * that its compiled form can be rebuilt on the thread making the change.
+ */
+class TreeListener : private juce::ValueTree::Listener
+{
+public:
+    TreeListener (const juce::ValueTree& tree_, std::function<void ()> onChange_)
+    : tree { tree_ }
+    , onChange { std::move (onChange_) }
+    {
+        tree.addListener (this);
+    }
+
+    ~TreeListener () override { tree.removeListener (this); }
+
+private:
+    void valueTreePropertyChanged (juce::ValueTree&, const juce::Identifier&) override { onChange (); }
+    void valueTreeChildAdded (juce::ValueTree&, juce::ValueTree&) override { onChange (); }
+    void valueTreeChildRemoved (juce::ValueTree&, juce::ValueTree&, int) override { onChange (); }
+    void valueTreeChildOrderChanged (juce::ValueTree&, int, int) override { onChange (); }
+    void valueTreeRedirected (juce::ValueTree&) override { onChange (); }
+
+    juce::ValueTree tree;
+    std::function<void ()> onChange;
+};
+} // namespace cello::utils::detail
+
 namespace cello::utils
 {
 
-void Rules::evaluate (const Context& context, Flags& flags) const
+Rules::Rules (const juce::ValueTree& tree)
+: cello::Object { "rules", tree }
 {
+    compile ();
+    listener = std::make_unique<detail::TreeListener> (data, [this] () { compile (); });
+}
+
+Rules::~Rules () = default;
+
+void Rules::compile ()
+{
+    program = {};
+    flagRules.clear ();
+
     // our children are a list of flag names, each of which contains
     // 1 or more conditions.
     for (const auto& flagRule : data)
@@ -46,6 +94,7 @@ void Rules::evaluate (const Context& context, Flags& flags) const
         // NOTE that the type of the `flagRule` tree may be any valid
         // juce::Identifier; it joins this set of conditions to the corresponding
         // flag in the `flags` object.
+        FlagRule compiled { flagRule.getType (), {} };
 
         // if this flag has been released, we don't need to evaluate it.
         // Note that we don't just check for the presence of the property,
@@ -55,13 +104,11 @@ void Rules::evaluate (const Context& context, Flags& flags) const
         {
             // set the flag to true (default) or a custom result value if
             // one is provided.
-            flags.setattr (flagRule.getType (), flagRule.getProperty (resultID, true));
+            compiled.conditions.emplace_back (program.alwaysTrue (), flagRule.getProperty (resultID, true));
+            flagRules.push_back (std::move (compiled));
             continue;
         }
 
-        // iterate through the conditions. The first one that passes
-        // will be used to update the state of the current flag. If none
-        // pass, the flag will be left in its current/default state.
         for (const auto& conditionTree : flagRule)
         {
             if (conditionTree.getType () != conditionID)
@@ -70,72 +117,247 @@ void Rules::evaluate (const Context& context, Flags& flags) const
                 jassertfalse;
                 continue;
             }
-            Condition condition { conditionTree };
-            if (const auto result { condition.evaluate (context) }; !result.isVoid ())
+            compiled.conditions.emplace_back (program.addCondition (conditionTree),
+                                              conditionTree.getProperty (resultID, true));
+        }
+        flagRules.push_back (std::move (compiled));
+    }
+}
+
+void Rules::evaluate (const Context& context, Flags& flags) const
+{
+    // a single evaluation is shared by all flags, so tests that appear
+    // in more than one flag's conditions are only run once.
+    CompiledRules::Evaluation evaluation { program, context };
+    for (const auto& flagRule : flagRules)
+    {
+        // iterate through the conditions. The first one that passes
+        // will be used to update the state of the current flag. If none
+        // pass, the flag will be left in its current/default state.
+        for (const auto& [node, result] : flagRule.conditions)
+        {
+            if (evaluation.isTrue (node))
             {
-                flags.setattr (flagRule.getType (), result);
+                flags.setattr (flagRule.flag, result);
                 break;
             }
         }
     }
 }
 
+Condition::Condition (const juce::ValueTree& tree)
+: cello::Object { "condition", tree }
+{
+    compile ();
+    listener = std::make_unique<detail::TreeListener> (data, [this] () { compile (); });
+}
+
+Condition::~Condition () = default;
+
+void Condition::compile ()
+{
+    program = {};
+    root    = program.addCondition (data);
+}
+
 juce::var Condition::evaluate (const Context& context) const
 {
-    juce::ValueTree contextTree { context };
-    for (const auto& child : data)
+    CompiledRules::Evaluation evaluation { program, context };
+    if (evaluation.isTrue (root))
+        return result ();
+    return juce::var ();
+}
+
+CompiledRules::NodeIndex CompiledRules::addCondition (const juce::ValueTree& tree)
+{
+    // an invalid test must fail the whole condition; if it only failed its
+    // own leaf, wrapping it in a `not` would make the condition pass.
+    invalidTest = false;
+    const auto root { compileNode (NodeType::all, tree) };
+    if (invalidTest)
+        return alwaysFalse ();
+    return root;
+}
+
+CompiledRules::NodeIndex CompiledRules::compileNode (NodeType type, const juce::ValueTree& tree)
+{
+    std::vector<NodeIndex> children;
+    for (const auto& child : tree)
     {
-        const auto propertyCount { child.getNumProperties () };
-        for (int i = 0; i < propertyCount; ++i)
+        const auto childType { child.getType () };
+        if (childType == allID)
+            children.push_back (compileNode (NodeType::all, child));
+        else if (childType == anyID)
+            children.push_back (compileNode (NodeType::any, child));
+        else if (childType == notID)
+            children.push_back (compileNode (NodeType::negate, child));
+        else
         {
-            const auto propertyName { child.getPropertyName (i) };
-            const auto propertyValue { child.getProperty (propertyName) };
-            const auto contextValue { contextTree.getProperty (child.getType ()) };
-            bool testResult { false };
-            if (propertyName == minID)
-                testResult = isAboveMin (propertyValue, contextValue);
-            else if (propertyName == maxID)
-                testResult = isBelowMax (propertyValue, contextValue);
-            else if (propertyName == allowedID)
-                testResult = isAllowed (propertyValue, contextValue);
-            else if (propertyName == disallowedID)
-                testResult = !isAllowed (propertyValue, contextValue);
-            else if (propertyName == valueID)
-                testResult = (propertyValue == contextValue);
-            else
+            // a test element; each of its properties is a separate test against
+            // the context value named by the child's type, and all of them
+            // must pass for the element to be a single passing operand.
+            std::vector<NodeIndex> propertyTests;
+            const auto propertyCount { child.getNumProperties () };
+            for (int i = 0; i < propertyCount; ++i)
             {
-                // we looked for an attribute that doesn't exist --assert and
-                // indicate that the condition is not met.
-                jassertfalse;
-                testResult = false;
+                const auto propertyName { child.getPropertyName (i) };
+                propertyTests.push_back (addTest (childType, propertyName, child.getProperty (propertyName)));
             }
-
-            if (!testResult)
-                return juce::var ();
+            children.push_back (addNode (NodeType::all, propertyTests));
         }
     }
-    return result ();
+    return addNode (type, children);
 }
 
-bool Condition::isAboveMin (const juce::var& test, const juce::var& actual) const
+CompiledRules::NodeIndex CompiledRules::addNode (NodeType type, const std::vector<NodeIndex>& children)
+{
+    // a single-child all/any is the same as the child itself.
+    if (type != NodeType::negate && children.size () == 1)
+        return children.front ();
+
+    juce::String signature { type == NodeType::all ? "all" : (type == NodeType::any ? "any" : "not") };
+    signature << "(";
+    for (const auto child : children)
+        signature << child << ",";
+    signature << ")";
+
+    if (const auto found { lookup.find (signature) }; found != lookup.end ())
+        return found->second;
+
+    const auto index { getNumNodes () };
+    nodes.push_back ({ type, static_cast<int> (operands.size ()), static_cast<int> (children.size ()) });
+    operands.insert (operands.end (), children.begin (), children.end ());
+    lookup.emplace (signature, index);
+    return index;
+}
+
+CompiledRules::NodeIndex CompiledRules::addTest (const juce::Identifier& key, const juce::Identifier& op,
+                                                 const juce::var& operand)
+{
+    Operator testOp;
+    if (op == minID)
+        testOp = Operator::min;
+    else if (op == maxID)
+        testOp = Operator::max;
+    else if (op == allowedID)
+        testOp = Operator::allowed;
+    else if (op == disallowedID)
+        testOp = Operator::disallowed;
+    else if (op == valueID)
+        testOp = Operator::value;
+    else
+    {
+        // we looked for an attribute that doesn't exist --assert and
+        // make sure that the enclosing condition is not met.
+        jassertfalse;
+        invalidTest = true;
+        return alwaysFalse ();
+    }
+
+    // the operand's type is part of the signature, because e.g. int and string
+    // operands compare differently.
+    juce::String signature { "test(" };
+    signature << key.toString () << "," << op.toString () << ",";
+    if (operand.isInt ())
+        signature << "i";
+    else if (operand.isInt64 ())
+        signature << "l";
+    else if (operand.isDouble ())
+        signature << "d";
+    else if (operand.isBool ())
+        signature << "b";
+    else
+        signature << "s";
+    signature << ":" << operand.toString () << ")";
+
+    if (const auto found { lookup.find (signature) }; found != lookup.end ())
+        return found->second;
+
+    Test test { key, testOp, operand, {} };
+    if (testOp == Operator::allowed || testOp == Operator::disallowed)
+    {
+        // the test value will be a comma-separated lists of strings; split it
+        // once here instead of on every evaluation.
+        test.values = juce::StringArray::fromTokens (operand.toString (), ",", "");
+    }
+
+    const auto index { getNumNodes () };
+    nodes.push_back ({ NodeType::test, getNumTests (), 0 });
+    tests.push_back (std::move (test));
+    lookup.emplace (signature, index);
+    return index;
+}
+
+bool CompiledRules::runTest (const Test& test, const juce::var& actual)
+{
+    switch (test.op)
+    {
+        case Operator::min:
+            return isAboveMin (test.operand, actual);
+        case Operator::max:
+            return isBelowMax (test.operand, actual);
+        case Operator::allowed:
+            return test.values.contains (actual.toString ());
+        case Operator::disallowed:
+            return !test.values.contains (actual.toString ());
+        case Operator::value:
+            return test.operand == actual;
+    }
+    jassertfalse;
+    return false;
+}
+
+bool CompiledRules::isAboveMin (const juce::var& test, const juce::var& actual)
 {
     if (test.isInt () && actual.isInt ())
         return static_cast<int> (actual) >= static_cast<int> (test);
     return actual.toString ().compareIgnoreCase (test.toString ()) >= 0;
 }
 
-bool Condition::isBelowMax (const juce::var& test, const juce::var& actual) const
+bool CompiledRules::isBelowMax (const juce::var& test, const juce::var& actual)
 {
     if (test.isInt () && actual.isInt ())
         return static_cast<int> (actual) < static_cast<int> (test);
     return actual.toString ().compareIgnoreCase (test.toString ()) < 0;
 }
 
-bool Condition::isAllowed (const juce::var& test, const juce::var& actual) const
+CompiledRules::Evaluation::Evaluation (const CompiledRules& program_, const Context& context_)
+: program { program_ }
+, context { context_ }
+, results (program_.nodes.size (), Result::unknown)
 {
-    // the test value will be a comma-separated lists of strings; actual is a single string.
-    const auto testValues { juce::StringArray::fromTokens (test.toString (), ",", "") };
-    return testValues.contains (actual.toString ());
+}
+
+bool CompiledRules::Evaluation::isTrue (NodeIndex index)
+{
+    jassert (index >= 0 && index < static_cast<int> (results.size ()));
+    if (results[index] != Result::unknown)
+        return results[index] == Result::passed;
+
+    const auto& node { program.nodes[index] };
+    bool passed { false };
+    if (node.type == NodeType::test)
+    {
+        const auto& test { program.tests[node.first] };
+        passed = runTest (test, context.getProperty (test.key));
+        ++testsEvaluated;
+    }
+    else
+    {
+        // std::all_of/any_of stop at the first child that decides the result.
+        const auto first { program.operands.begin () + node.first };
+        const auto last { first + node.count };
+        const auto childIsTrue = [this] (NodeIndex child) { return isTrue (child); };
+        if (node.type == NodeType::any)
+            passed = std::any_of (first, last, childIsTrue);
+        else if (node.type == NodeType::all)
+            passed = std::all_of (first, last, childIsTrue);
+        else
+            passed = !std::all_of (first, last, childIsTrue);
+    }
+
+    results[index] = passed ? Result::passed : Result::failed;
+    return passed;
 }
 } // namespace cello::utils
 
@@ -20,6 +20,13 @@
 #pragma once
 
 #include <cello/cello/cello_object.h>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
 namespace cello::utils
 {
 /**
@@ -51,6 +58,139 @@ public:
     }
 };
 
+namespace detail
+{
+class TreeListener;
+} // namespace detail
+
+/**
+ * @brief A set of rule conditions compiled into a flat graph of boolean
+ * expression nodes.
+ *
+ * Each distinct test (context key, operator, operand) and each distinct
+ * `all`/`any`/`not` expression is stored exactly once, so conditions (and
+ * flags) that repeat the same logic share the same nodes. During an
+ * Evaluation, the result of each node is remembered, so no test is run more
+ * than once per context, and `all`/`any` nodes stop evaluating their children
+ * as soon as their own result is known.
+ */
+class CompiledRules
+{
+public:
+    using NodeIndex = int;
+
+    /**
+     * @brief Compile a `condition` tree; all of its children must pass.
+     * Children may be test elements, e.g. `<cohort min="0" max="50"/>`, or
+     * nested `all`, `any`, and `not` nodes. If any test element uses an
+     * unknown attribute, the whole condition compiles to always-false.
+     *
+     * @param tree
+     * @return NodeIndex of the root of the compiled expression.
+     */
+    NodeIndex addCondition (const juce::ValueTree& tree);
+
+    /**
+     * @return NodeIndex of an expression that always evaluates to true.
+     */
+    NodeIndex alwaysTrue () { return addNode (NodeType::all, {}); }
+
+    /**
+     * @return NodeIndex of an expression that always evaluates to false.
+     */
+    NodeIndex alwaysFalse () { return addNode (NodeType::any, {}); }
+
+    int getNumNodes () const { return static_cast<int> (nodes.size ()); }
+    int getNumTests () const { return static_cast<int> (tests.size ()); }
+
+    /**
+     * @brief Evaluates compiled expressions against a single context,
+     * caching the result of every node that it visits.
+     */
+    class Evaluation
+    {
+    public:
+        Evaluation (const CompiledRules& program, const Context& context);
+
+        /**
+         * @brief Evaluate (or look up the cached result of) a node.
+         *
+         * @param node
+         * @return true if the expression rooted at `node` passes.
+         */
+        bool isTrue (NodeIndex node);
+
+        /**
+         * @return the number of tests actually run against the context so far.
+         */
+        int getNumTestsEvaluated () const { return testsEvaluated; }
+
+    private:
+        enum class Result : std::int8_t
+        {
+            unknown,
+            failed,
+            passed
+        };
+
+        const CompiledRules& program;
+        juce::ValueTree context;
+        std::vector<Result> results;
+        int testsEvaluated { 0 };
+    };
+
+private:
+    enum class NodeType
+    {
+        test,
+        all,
+        any,
+        negate
+    };
+
+    enum class Operator
+    {
+        min,
+        max,
+        allowed,
+        disallowed,
+        value
+    };
+
+    struct Node
+    {
+        NodeType type;
+        /// index into `tests` for a test node, else into `operands`.
+        int first;
+        int count;
+    };
+
+    struct Test
+    {
+        juce::Identifier key;
+        Operator op;
+        juce::var operand;
+        /// pre-split operand for the `allowed`/`disallowed` operators.
+        juce::StringArray values;
+    };
+
+    NodeIndex compileNode (NodeType type, const juce::ValueTree& tree);
+    NodeIndex addNode (NodeType type, const std::vector<NodeIndex>& children);
+    NodeIndex addTest (const juce::Identifier& key, const juce::Identifier& op, const juce::var& operand);
+
+    static bool runTest (const Test& test, const juce::var& actual);
+    static bool isAboveMin (const juce::var& test, const juce::var& actual);
+    static bool isBelowMax (const juce::var& test, const juce::var& actual);
+
+    std::vector<Node> nodes;
+    std::vector<NodeIndex> operands;
+    std::vector<Test> tests;
+    /// signature of each node -> its index, used to share identical expressions.
+    std::map<juce::String, NodeIndex> lookup;
+    /// set when the condition being compiled contains an invalid test.
+    bool invalidTest { false };
+};
+
 /**
  * @brief The current set of rules to be used to determine the settings
  * of each flag based on the current user, platform, date, and other
@@ -60,10 +200,8 @@ public:
 class Rules : public cello::Object
 {
 public:
-    Rules (const juce::ValueTree& tree)
-    : cello::Object { "rules", tree }
-    {
-    }
+    Rules (const juce::ValueTree& tree);
+    ~Rules ();
 
     /**
      * @brief Evaluate the rules in the context of the current runtime
@@ -73,10 +211,34 @@ public:
      * application based on the combination of the rules and the current
      * application context.
      *
+     * The rules are compiled on construction and recompiled on the thread
+     * that modifies the rule tree, so (as with any ValueTree) don't modify
+     * the tree while another thread is evaluating it.
+     *
      * @param context
      * @param flags
      */
     void evaluate (const Context& context, Flags& flags) const;
+
+private:
+    /**
+     * @brief Rebuild the compiled form of the rules.
+     */
+    void compile ();
+
+    struct FlagRule
+    {
+        juce::Identifier flag;
+        /// conditions in order; the first that passes supplies the flag's value.
+        std::vector<std::pair<CompiledRules::NodeIndex, juce::var>> conditions;
+    };
+
+    CompiledRules program;
+    std::vector<FlagRule> flagRules;
+    /// recompiles whenever the rule tree changes.
+    std::unique_ptr<detail::TreeListener> listener;
+
+    JUCE_DECLARE_NON_COPYABLE (Rules)
 };
 
 class Condition : public cello::Object
@@ -95,13 +257,28 @@ public:
      *       <cohort min="0" max="50"/>
      *       <time min="2024-01-01" max="2024-01-07"/>
      *  </condition>
+     *  <condition>
+     *       <!-- beta users, except on linux or in the first 10 cohorts -->
+     *       <type allowed="beta" />
+     *       <not>
+     *           <any>
+     *               <platform value="linux" />
+     *               <cohort max="10" />
+     *           </any>
+     *       </not>
+     *  </condition>
+     *
+     * Each child element of a condition, `all`, `any`, or `not` is one
+     * operand; a test element like `<cohort min="0" max="50"/>` passes only
+     * if all of its attributes pass. All operands of a condition (or an `all`
+     * node) must pass, at least one operand of an `any` node must pass, and
+     * `not` passes only when its operands would not all pass. These node
+     * names are reserved and can't be used as context keys.
      *
      * @param tree
      */
-    Condition (const juce::ValueTree& tree)
-    : cello::Object { "condition", tree }
-    {
-    }
+    Condition (const juce::ValueTree& tree);
+    ~Condition ();
 
     /**
      * @brief Evaluate this condition in the context of the current
@@ -122,9 +299,17 @@ private:
      */
     juce::var result () const { return data.getProperty ("result", true); }
 
-    bool isAboveMin (const juce::var& test, const juce::var& actual) const;
-    bool isBelowMax (const juce::var& test, const juce::var& actual) const;
-    bool isAllowed (const juce::var& test, const juce::var& actual) const;
+    /**
+     * @brief Rebuild the compiled form of the condition.
+     */
+    void compile ();
+
+    CompiledRules program;
+    CompiledRules::NodeIndex root { 0 };
+    /// recompiles whenever the condition tree changes.
+    std::unique_ptr<detail::TreeListener> listener;
+
+    JUCE_DECLARE_NON_COPYABLE (Condition)
 };
 
 } // namespace cello::utils
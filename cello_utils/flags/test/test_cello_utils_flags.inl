@@ -197,6 +197,177 @@ public:
                   expect (condition.evaluate (context).isVoid ());
               });
 
+        test ("condition: nested all/any/not",
+              [this] ()
+              {
+                  // beta AND NOT (platform linux OR cohort < 10)
+                  // clang-format off
+                  juce::ValueTree tree { "condition", {}, {
+                      { "type", { { "allowed", "beta" } } },
+                      { "not", {}, {
+                          { "any", {}, {
+                              { "platform", { { "value", "linux" } } },
+                              { "cohort", { { "max", 10 } } }
+                          }}
+                      }}
+                  }};
+                  // clang-format on
+                  cello::utils::Condition condition { tree };
+                  cello::utils::Context context;
+                  context.setattr ("type", juce::String { "beta" });
+                  context.setattr ("platform", juce::String { "mac" });
+                  context.setattr ("cohort", 20);
+                  expect (!condition.evaluate (context).isVoid ());
+                  context.setattr ("cohort", 5);
+                  expect (condition.evaluate (context).isVoid ());
+                  context.setattr ("cohort", 20);
+                  context.setattr ("platform", juce::String { "linux" });
+                  expect (condition.evaluate (context).isVoid ());
+                  context.setattr ("platform", juce::String { "mac" });
+                  context.setattr ("type", juce::String { "dev" });
+                  expect (condition.evaluate (context).isVoid ());
+
+                  // an explicit `all` inside an `any`
+                  // clang-format off
+                  juce::ValueTree anyTree { "condition", {}, {
+                      { "any", {}, {
+                          { "type", { { "value", "dev" } } },
+                          { "all", {}, {
+                              { "type", { { "value", "beta" } } },
+                              { "cohort", { { "min", 10 } } }
+                          }}
+                      }}
+                  }};
+                  // clang-format on
+                  cello::utils::Condition anyCondition { anyTree };
+                  expect (!anyCondition.evaluate (context).isVoid ());
+                  context.setattr ("type", juce::String { "beta" });
+                  expect (!anyCondition.evaluate (context).isVoid ());
+                  context.setattr ("cohort", 5);
+                  expect (anyCondition.evaluate (context).isVoid ());
+              });
+
+        test ("condition: multi-property tests inside any/not",
+              [this] ()
+              {
+                  // each test element is one operand of `any`: the range must
+                  // hold as a whole, not just one of its bounds.
+                  // clang-format off
+                  juce::ValueTree anyTree { "condition", {}, {
+                      { "any", {}, {
+                          { "cohort", { { "min", 10 }, { "max", 20 } } },
+                          { "platform", { { "value", "linux" } } }
+                      }}
+                  }};
+                  juce::ValueTree notTree { "condition", {}, {
+                      { "not", {}, {
+                          { "cohort", { { "min", 10 }, { "max", 20 } } }
+                      }}
+                  }};
+                  // clang-format on
+                  cello::utils::Condition anyCondition { anyTree };
+                  cello::utils::Condition notCondition { notTree };
+                  cello::utils::Context context;
+                  context.setattr ("platform", juce::String { "mac" });
+                  context.setattr ("cohort", 5);
+                  expect (anyCondition.evaluate (context).isVoid ());
+                  expect (!notCondition.evaluate (context).isVoid ());
+                  context.setattr ("cohort", 15);
+                  expect (!anyCondition.evaluate (context).isVoid ());
+                  expect (notCondition.evaluate (context).isVoid ());
+                  context.setattr ("cohort", 25);
+                  expect (anyCondition.evaluate (context).isVoid ());
+                  expect (!notCondition.evaluate (context).isVoid ());
+                  context.setattr ("platform", juce::String { "linux" });
+                  expect (!anyCondition.evaluate (context).isVoid ());
+              });
+
+        test ("condition: invalid test fails the whole condition",
+              [this] ()
+              {
+                  // a typo'd attribute inside a `not` must not turn the condition on.
+                  // clang-format off
+                  juce::ValueTree tree { "condition", {}, {
+                      { "not", {}, {
+                          { "cohort", { { "mn", 5 } } }
+                      }}
+                  }};
+                  // clang-format on
+                  cello::utils::Condition condition { tree };
+                  cello::utils::Context context;
+                  context.setattr ("cohort", 2);
+                  expect (condition.evaluate (context).isVoid ());
+                  context.setattr ("cohort", 8);
+                  expect (condition.evaluate (context).isVoid ());
+              });
+
+        test ("condition: changes to the tree are picked up",
+              [this] ()
+              {
+                  // clang-format off
+                  juce::ValueTree tree { "condition", {},
+                      { { "cohort", { { "min", 5 } } }, }
+                  };
+                  // clang-format on
+                  cello::utils::Condition condition { tree };
+                  cello::utils::Context context;
+                  context.setattr ("cohort", 4);
+                  expect (condition.evaluate (context).isVoid ());
+                  tree.getChild (0).setProperty ("min", 3, nullptr);
+                  expect (!condition.evaluate (context).isVoid ());
+              });
+
+        test ("compiled: shared expressions are evaluated once",
+              [this] ()
+              {
+                  // clang-format off
+                  juce::ValueTree first { "condition", {}, {
+                      { "type", { { "allowed", "beta" } } },
+                      { "not", {}, {
+                          { "any", {}, {
+                              { "platform", { { "value", "linux" } } },
+                              { "cohort", { { "max", 10 } } }
+                          }}
+                      }}
+                  }};
+                  juce::ValueTree second { "condition", {}, {
+                      { "cohort", { { "min", 3 } } },
+                      { "not", {}, {
+                          { "any", {}, {
+                              { "platform", { { "value", "linux" } } },
+                              { "cohort", { { "max", 10 } } }
+                          }}
+                      }}
+                  }};
+                  // clang-format on
+                  cello::utils::CompiledRules program;
+                  const auto firstNode { program.addCondition (first) };
+                  const auto nodeCount { program.getNumNodes () };
+                  // the same condition compiles to the same node.
+                  expect (program.addCondition (first) == firstNode);
+                  expectEquals (program.getNumNodes (), nodeCount);
+                  const auto secondNode { program.addCondition (second) };
+                  // 4 distinct tests; `not (any ...)` is shared between conditions.
+                  expectEquals (program.getNumTests (), 4);
+
+                  cello::utils::Context context;
+                  context.setattr ("type", juce::String { "beta" });
+                  context.setattr ("platform", juce::String { "mac" });
+                  context.setattr ("cohort", 20);
+                  cello::utils::CompiledRules::Evaluation evaluation { program, context };
+                  expect (evaluation.isTrue (firstNode));
+                  expectEquals (evaluation.getNumTestsEvaluated (), 3);
+                  expect (evaluation.isTrue (secondNode));
+                  // only `cohort min=3` is new.
+                  expectEquals (evaluation.getNumTestsEvaluated (), 4);
+
+                  // `any` stops at the first passing child, `all` at the first failure.
+                  context.setattr ("platform", juce::String { "linux" });
+                  cello::utils::CompiledRules::Evaluation shortCircuit { program, context };
+                  expect (!shortCircuit.isTrue (firstNode));
+                  expectEquals (shortCircuit.getNumTestsEvaluated (), 2);
+              });
+
         setup (
             [this] ()
             {
@@ -320,6 +491,89 @@ public:
                   expect (flags->test2);
                   expect (flags->test4 != juce::String ("customValue"));
               });
+
+        test ("flags: nested rules",
+              [this] ()
+              {
+                  // clang-format off
+                  juce::ValueTree rules { "rules", {},
+                    {
+                        { "test1", {}, {
+                            { "condition", {}, {
+                                { "type", { { "allowed", "beta" } } },
+                                { "not", {}, {
+                                    { "any", {}, {
+                                        { "platform", { { "value", "linux" } } },
+                                        { "cohort", { { "max", 10 } } }
+                                    }}
+                                }}
+                            }}
+                        }},
+                        { "test4", {}, {
+                            { "condition", { { "result", "excluded" } }, {
+                                { "any", {}, {
+                                    { "platform", { { "value", "linux" } } },
+                                    { "cohort", { { "max", 10 } } }
+                                }}
+                            }}
+                        }}
+                    }
+                  };
+                  // clang-format on
+
+                  cello::utils::Rules ruleSet { rules };
+
+                  context->setattr ("type", juce::String ("beta"));
+                  context->setattr ("platform", juce::String ("mac"));
+                  context->setattr ("cohort", 20);
+                  ruleSet.evaluate (*context, *flags);
+                  expect (flags->test1);
+                  expect (cmpStr (flags->test4, "test4"));
+
+                  flags = std::make_unique<UnitTestFlags> (nullptr);
+                  context->setattr ("platform", juce::String ("linux"));
+                  ruleSet.evaluate (*context, *flags);
+                  expect (!flags->test1);
+                  expect (cmpStr (flags->test4, "excluded"));
+              });
+
+        test ("flags: changes to the rules tree are picked up",
+              [this] ()
+              {
+                  // clang-format off
+                  juce::ValueTree rules { "rules", {},
+                    {
+                        { "test1", {}, {
+                            { "condition", {}, {
+                                { "cohort", { { "min", 3 } } }
+                            }}
+                        }}
+                    }
+                  };
+                  // clang-format on
+
+                  cello::utils::Rules ruleSet { rules };
+                  ruleSet.evaluate (*context, *flags);
+                  expect (!flags->test1);
+
+                  // edit a test in place
+                  rules.getChild (0).getChild (0).getChild (0).setProperty ("min", 1, nullptr);
+                  ruleSet.evaluate (*context, *flags);
+                  expect (flags->test1);
+
+                  // add a flag rule
+                  flags = std::make_unique<UnitTestFlags> (nullptr);
+                  rules.appendChild (juce::ValueTree { "test2", { { "released", true } } }, nullptr);
+                  ruleSet.evaluate (*context, *flags);
+                  expect (flags->test1);
+                  expect (flags->test2);
+
+                  // un-release it again
+                  flags = std::make_unique<UnitTestFlags> (nullptr);
+                  rules.getChild (1).setProperty ("released", false, nullptr);
+                  ruleSet.evaluate (*context, *flags);
+                  expect (!flags->test2);
+              });
     }
 
 private: